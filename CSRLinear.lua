@@ -0,0 +1,82 @@
+local CSRLinear, parent = torch.class('nn.CSRLinear', 'nn.CSRModule')
+
+-- A Linear layer whose (outputSize, inputSize) weight matrix is stored in
+-- compressed sparse rows (see CSRModule).
+function CSRLinear:__init(inputSize, outputSize, nnz)
+  parent.__init(self)
+  self.inputSize = inputSize
+  self.outputSize = outputSize
+
+  self.weight = torch.FloatTensor(nnz):zero()
+  self.bias = torch.FloatTensor(outputSize):zero()
+  self.gradWeight = torch.FloatTensor(nnz):zero()
+  self.gradBias = torch.FloatTensor(outputSize):zero()
+  self.rowPtr = torch.IntTensor(outputSize+1):zero()
+  self.colIdx = torch.IntTensor(nnz):zero()
+
+  self.output = torch.FloatTensor()
+  self.gradInput = torch.FloatTensor()
+end
+
+-- transposes a (batch, features) input into the (features, batch) layout
+-- the sparse kernels work on
+local function columns(buffer, x)
+  local x2 = x:dim() == 1 and x:view(1, -1) or x
+  buffer:resize(x2:size(2), x2:size(1)):copy(x2:t())
+  return buffer
+end
+
+function CSRLinear:csrmm(transpose, n, dense, out)
+  caffegraph.C.csrmm(transpose, self.outputSize, n, torch.data(self.rowPtr),
+    torch.data(self.colIdx), torch.data(self.weight), torch.data(dense), torch.data(out))
+end
+
+function CSRLinear:updateOutput(input)
+  assert(torch.type(input) == 'torch.FloatTensor', 'CSRLinear only supports float tensors')
+  self._input = columns(self._input or input.new(), input)
+  local n = self._input:size(2)
+
+  self._output = self._output or input.new()
+  self._output:resize(self.outputSize, n):zero()
+  self:csrmm(0, n, self._input, self._output)
+
+  self.output:resize(n, self.outputSize):copy(self._output:t())
+  self.output:add(self.bias:view(1, self.outputSize):expandAs(self.output))
+  if input:dim() == 1 then
+    self.output:resize(self.outputSize)
+  end
+  return self.output
+end
+
+function CSRLinear:updateGradInput(input, gradOutput)
+  self._gradOutput = columns(self._gradOutput or gradOutput.new(), gradOutput)
+  local n = self._gradOutput:size(2)
+
+  self._gradInput = self._gradInput or input.new()
+  self._gradInput:resize(self.inputSize, n):zero()
+  self:csrmm(1, n, self._gradOutput, self._gradInput)
+
+  self.gradInput:resizeAs(input):copy(self._gradInput:t())
+  return self.gradInput
+end
+
+function CSRLinear:accGradParameters(input, gradOutput, scale)
+  scale = scale or 1
+  self._input = columns(self._input or input.new(), input)
+  self._gradOutput = columns(self._gradOutput or gradOutput.new(), gradOutput)
+  local n = self._input:size(2)
+
+  caffegraph.C.csrgrad(self.outputSize, n, torch.data(self.rowPtr), torch.data(self.colIdx),
+    torch.data(self._gradOutput), torch.data(self._input), scale, torch.data(self.gradWeight))
+  self.gradBias:add(scale, self._gradOutput:sum(2):view(self.outputSize))
+end
+
+function CSRLinear:clearState()
+  nn.utils.clear(self, '_input', '_output', '_gradOutput', '_gradInput')
+  return parent.clearState(self)
+end
+
+function CSRLinear:__tostring__()
+  return torch.type(self) ..
+    string.format('(%d -> %d, %d nonzeros)', self.inputSize, self.outputSize, self.weight:nElement())
+end
@@ -0,0 +1,14 @@
+local CSRModule, parent = torch.class('nn.CSRModule', 'nn.Module')
+
+-- Base of the modules whose weight matrix is stored in compressed sparse
+-- rows: weight holds the nonzero values, rowPtr the offset of each row into
+-- them and colIdx the column of each value.
+
+-- the sparsity pattern is made of indices, which must not be converted
+function CSRModule:type(type, tensorCache)
+  local rowPtr, colIdx = self.rowPtr, self.colIdx
+  self.rowPtr, self.colIdx = nil, nil
+  parent.type(self, type, tensorCache)
+  self.rowPtr, self.colIdx = rowPtr, colIdx
+  return self
+end
@@ -0,0 +1,149 @@
+local CSRSpatialConvolution, parent = torch.class('nn.CSRSpatialConvolution', 'nn.CSRModule')
+
+-- A SpatialConvolution whose (nOutputPlane, nInputPlane*kH*kW) weight matrix
+-- is stored in compressed sparse rows (see CSRModule). The input is unfolded
+-- into columns and multiplied by the sparse weights.
+function CSRSpatialConvolution:__init(nInputPlane, nOutputPlane, kW, kH, dW, dH, padW, padH, nnz)
+  parent.__init(self)
+  self.nInputPlane = nInputPlane
+  self.nOutputPlane = nOutputPlane
+  self.kW, self.kH = kW, kH
+  self.dW, self.dH = dW, dH
+  self.padW, self.padH = padW, padH
+
+  self.weight = torch.FloatTensor(nnz):zero()
+  self.bias = torch.FloatTensor(nOutputPlane):zero()
+  self.gradWeight = torch.FloatTensor(nnz):zero()
+  self.gradBias = torch.FloatTensor(nOutputPlane):zero()
+  self.rowPtr = torch.IntTensor(nOutputPlane+1):zero()
+  self.colIdx = torch.IntTensor(nnz):zero()
+
+  self.output = torch.FloatTensor()
+  self.gradInput = torch.FloatTensor()
+end
+
+-- the (C, oH, oW) input pixels seen by kernel tap (i, j) at every output location
+function CSRSpatialConvolution:window(padded, i, j, oH, oW)
+  return padded:narrow(2, i, (oH-1)*self.dH+1):narrow(3, j, (oW-1)*self.dW+1)
+    :unfold(2, 1, self.dH):unfold(3, 1, self.dW):select(5, 1):select(4, 1)
+end
+
+-- unfolds a (C, H, W) sample into (C*kH*kW, oH*oW) columns
+function CSRSpatialConvolution:im2col(sample, oH, oW)
+  local padded = sample
+  if self.padW > 0 or self.padH > 0 then
+    self._padded = self._padded or sample.new()
+    self._padded:resize(sample:size(1), sample:size(2) + 2*self.padH,
+                        sample:size(3) + 2*self.padW):zero()
+    self._padded:narrow(2, self.padH+1, sample:size(2))
+                :narrow(3, self.padW+1, sample:size(3)):copy(sample)
+    padded = self._padded
+  end
+
+  self._columns = self._columns or sample.new()
+  self._columns:resize(self.nInputPlane, self.kH, self.kW, oH, oW)
+  for i=1,self.kH do
+    for j=1,self.kW do
+      self._columns[{{}, i, j}]:copy(self:window(padded, i, j, oH, oW))
+    end
+  end
+  return self._columns:view(-1, oH*oW)
+end
+
+-- accumulates (C*kH*kW, oH*oW) columns back into a (C, H, W) sample
+function CSRSpatialConvolution:col2im(columns, sample, oH, oW)
+  self._padded = self._padded or sample.new()
+  self._padded:resize(sample:size(1), sample:size(2) + 2*self.padH,
+                      sample:size(3) + 2*self.padW):zero()
+  local columns5d = columns:view(self.nInputPlane, self.kH, self.kW, oH, oW)
+  for i=1,self.kH do
+    for j=1,self.kW do
+      self:window(self._padded, i, j, oH, oW):add(columns5d[{{}, i, j}])
+    end
+  end
+  sample:copy(self._padded:narrow(2, self.padH+1, sample:size(2))
+                          :narrow(3, self.padW+1, sample:size(3)))
+end
+
+function CSRSpatialConvolution:csrmm(transpose, n, dense, out)
+  caffegraph.C.csrmm(transpose, self.nOutputPlane, n, torch.data(self.rowPtr),
+    torch.data(self.colIdx), torch.data(self.weight), torch.data(dense), torch.data(out))
+end
+
+local function makeBatch(input)
+  return input:dim() == 3 and input:view(1, input:size(1), input:size(2), input:size(3)) or input
+end
+
+function CSRSpatialConvolution:outputSize(input)
+  local oH = math.floor((input:size(3) + 2*self.padH - self.kH) / self.dH) + 1
+  local oW = math.floor((input:size(4) + 2*self.padW - self.kW) / self.dW) + 1
+  return oH, oW
+end
+
+function CSRSpatialConvolution:updateOutput(input)
+  assert(torch.type(input) == 'torch.FloatTensor',
+    'CSRSpatialConvolution only supports float tensors')
+  local batch = makeBatch(input)
+  local oH, oW = self:outputSize(batch)
+
+  self.output:resize(batch:size(1), self.nOutputPlane, oH, oW)
+  for b=1,batch:size(1) do
+    local columns = self:im2col(batch[b], oH, oW)
+    local out = self.output[b]:view(self.nOutputPlane, oH*oW)
+    out:copy(self.bias:view(self.nOutputPlane, 1):expandAs(out))
+    self:csrmm(0, oH*oW, columns, out)
+  end
+
+  if input:dim() == 3 then
+    self.output = self.output[1]
+  end
+  return self.output
+end
+
+function CSRSpatialConvolution:updateGradInput(input, gradOutput)
+  local batch = makeBatch(input)
+  local gradBatch = makeBatch(gradOutput)
+  local oH, oW = self:outputSize(batch)
+
+  self._gradColumns = self._gradColumns or input.new()
+  self.gradInput:resizeAs(batch)
+  for b=1,batch:size(1) do
+    local gradOut = gradBatch[b]:contiguous():view(self.nOutputPlane, oH*oW)
+    self._gradColumns:resize(self.nInputPlane*self.kH*self.kW, oH*oW):zero()
+    self:csrmm(1, oH*oW, gradOut, self._gradColumns)
+    self:col2im(self._gradColumns, self.gradInput[b], oH, oW)
+  end
+
+  if input:dim() == 3 then
+    self.gradInput = self.gradInput[1]
+  end
+  return self.gradInput
+end
+
+function CSRSpatialConvolution:accGradParameters(input, gradOutput, scale)
+  scale = scale or 1
+  local batch = makeBatch(input)
+  local gradBatch = makeBatch(gradOutput)
+  local oH, oW = self:outputSize(batch)
+
+  for b=1,batch:size(1) do
+    local columns = self:im2col(batch[b], oH, oW)
+    local gradOut = gradBatch[b]:contiguous():view(self.nOutputPlane, oH*oW)
+    caffegraph.C.csrgrad(self.nOutputPlane, oH*oW, torch.data(self.rowPtr),
+      torch.data(self.colIdx), torch.data(gradOut), torch.data(columns), scale,
+      torch.data(self.gradWeight))
+    self.gradBias:add(scale, gradOut:sum(2):view(self.nOutputPlane))
+  end
+end
+
+function CSRSpatialConvolution:clearState()
+  nn.utils.clear(self, '_padded', '_columns', '_gradColumns')
+  return parent.clearState(self)
+end
+
+function CSRSpatialConvolution:__tostring__()
+  return torch.type(self) ..
+    string.format('(%d -> %d, %dx%d, %d,%d, %d,%d, %d nonzeros)', self.nInputPlane,
+      self.nOutputPlane, self.kW, self.kH, self.dW, self.dH, self.padW, self.padH,
+      self.weight:nElement())
+end
@@ -0,0 +1,109 @@
+require 'nn'
+
+local bench = {}
+
+-- builds a random input (or table of inputs) for the given per-sample sizes
+local function makeInput(inputSizes, batchSize)
+  local inputs = {}
+  for i,size in ipairs(inputSizes) do
+    local dims = {batchSize}
+    for j=1,#size do dims[j+1] = size[j] end
+    inputs[i] = torch.FloatTensor(torch.LongStorage(dims)):uniform(-1, 1)
+  end
+  return #inputs == 1 and inputs[1] or inputs
+end
+
+-- flattens a (possibly nested) table of output tensors into a list
+local function flattenOutput(output, list)
+  list = list or {}
+  if torch.isTensor(output) then
+    list[#list+1] = output
+  else
+    for i=1,#output do flattenOutput(output[i], list) end
+  end
+  return list
+end
+
+local function percentile(sorted, p)
+  local rank = math.max(1, math.ceil(p / 100 * #sorted))
+  return sorted[rank]
+end
+
+-- Times forward passes of `model` over a sweep of batch sizes.
+-- opts: batchSizes (default {1, 2, 4, 8, 16, 32}), iters (default 50),
+-- warmup (default 5). Returns one entry per batch size with latency
+-- percentiles in milliseconds and throughput in images/sec.
+function bench.benchmark(model, inputSizes, opts)
+  opts = opts or {}
+  local batchSizes = opts.batchSizes or {1, 2, 4, 8, 16, 32}
+  local iters = opts.iters or 50
+  local warmup = opts.warmup or 5
+
+  model:evaluate()
+
+  local timer = torch.Timer()
+  local results = {}
+  for _,batchSize in ipairs(batchSizes) do
+    local input = makeInput(inputSizes, batchSize)
+    for i=1,warmup do model:forward(input) end
+
+    local times = {}
+    for i=1,iters do
+      timer:reset()
+      model:forward(input)
+      times[i] = timer:time().real * 1000
+    end
+    table.sort(times)
+
+    local total = 0
+    for i=1,#times do total = total + times[i] end
+
+    results[#results+1] = {
+      batchSize = batchSize,
+      p50 = percentile(times, 50),
+      p90 = percentile(times, 90),
+      p99 = percentile(times, 99),
+      mean = total / iters,
+      imagesPerSec = batchSize * iters / (total / 1000),
+    }
+  end
+  return results
+end
+
+-- Runs both models on the same random input and checks that every output
+-- agrees within `opts.tolerance` (default 1e-4, absolute).
+-- Returns whether they match and the largest absolute difference seen.
+function bench.compare(modelA, modelB, inputSizes, opts)
+  opts = opts or {}
+  local tolerance = opts.tolerance or 1e-4
+  local input = makeInput(inputSizes, opts.batchSize or 2)
+
+  modelA:evaluate()
+  modelB:evaluate()
+  local outA = flattenOutput(modelA:forward(input))
+  local outB = flattenOutput(modelB:forward(input))
+  if #outA ~= #outB then
+    return false, math.huge
+  end
+
+  local maxDiff = 0
+  for i=1,#outA do
+    if outA[i]:nElement() ~= outB[i]:nElement() then
+      return false, math.huge
+    end
+    local diff = (outA[i] - outB[i]:viewAs(outA[i])):abs():max()
+    maxDiff = math.max(maxDiff, diff)
+  end
+  return maxDiff <= tolerance, maxDiff
+end
+
+function bench.report(results)
+  print(string.format('%8s %10s %10s %10s %10s %12s',
+    'batch', 'mean(ms)', 'p50(ms)', 'p90(ms)', 'p99(ms)', 'images/sec'))
+  for _,r in ipairs(results) do
+    print(string.format('%8d %10.2f %10.2f %10.2f %10.2f %12.1f',
+      r.batchSize, r.mean, r.p50, r.p90, r.p99, r.imagesPerSec))
+  end
+end
+
+return bench
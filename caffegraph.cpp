@@ -1,13 +1,16 @@
 #include <TH/TH.h>
 #include <algorithm>
+#include <atomic>
 #include <fcntl.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <locale>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
@@ -17,6 +20,7 @@
 #include <google/protobuf/text_format.h>
 
 #include "caffe.pb.h"
+#include "container.h"
 #include "layers.h"
 
 using google::protobuf::io::FileInputStream;
@@ -26,15 +30,24 @@ using google::protobuf::io::CodedInputStream;
 #define print(VAL) std::cout << VAL << std::endl; // DEBUGGING
 
 extern "C" {
-  void loadModel(void** handle, const char* prototxt, const char* caffemodel);
+  void loadModel(void** handle, const char* prototxt, const char* caffemodel,
+                 const LoadOptions* opts);
   void buildModel(const void** handle, const char* luafile);
-  void getParams(const void** handle, THFloatTensor*** params);
+  void getParams(const void** handle, LayerParams* params, int num_layers);
   void freeModel(void** handle);
+  int compressModel(const char* caffemodel, const char* container);
+  void* loadModelAsync(const char* prototxt, const char* caffemodel, const char* luafile,
+                       const LoadOptions* opts);
+  void getParamsAsync(void* job, LayerParams* params, int num_layers);
+  int pollJob(void* job);
+  int waitJob(void* job);
+  void freeJob(void* job);
 }
 
 class Model {
   public:
-    Model(caffe::NetParameter* net_params) : net_params(net_params) {
+    Model(caffe::NetParameter* net_params, const LoadOptions& opts, Container* container)
+      : net_params(net_params), container(container) {
       int num_layers = net_params->layer_size();
       std::unordered_map<std::string, Layer*> modmap(num_layers);
 
@@ -75,12 +88,14 @@ class Model {
           tips.erase(bottom);
         }
 
-        Layer* layer = Layer::MakeLayer(layer_params, inputs);
+        Layer* layer = Layer::MakeLayer(layer_params, inputs, opts, container);
         for(std::string top : layer_params.top()) {
           modmap[top] = layer;
           tips.insert(top);
         }
         layers.push_back(layer);
+        if(i == -1)
+          root_layers.push_back(layer);
       }
     }
 
@@ -129,29 +144,64 @@ class Model {
       }
       out << "})\n\n";
 
-      out << "return model, modmap" << std::endl;
+      // per-sample input shapes (without the batch dimension)
+      out << "input_sizes = {";
+      for(int i = 0; i < root_layers.size(); ++i) {
+        std::vector<int> input_size = root_layers[i]->GetOutputSizes()[0];
+        out << "{";
+        for(int j = 0; j < input_size.size(); ++j) {
+          out << input_size[j];
+          if(j < input_size.size()-1) out << ", ";
+        }
+        out << "}";
+        if(i < root_layers.size()-1) out << ", ";
+      }
+      out << "}\n\n";
+
+      out << "return model, modmap, input_sizes" << std::endl;
     }
 
-    void Parameterize(THFloatTensor*** tensors) {
-      for(int i = 0; i < layers.size(); ++i)
-        layers[i]->Parameterize(tensors[i]);
+    void Parameterize(LayerParams* params, int num_layers) {
+      int n = std::min<int>(layers.size(), num_layers);
+      for(int i = 0; i < n; ++i)
+        layers[i]->Parameterize(params[i].tensors, params[i].indices);
+
+      // inflate the container blobs of every layer in one pass, so that
+      // the many small ones (biases, BatchNorm stats, 1x1 and 3x3
+      // convolutions) are read and inflated in parallel too
+      std::vector<Container::Target> targets;
+      for(int i = 0; i < n; ++i)
+        for(auto& queued : layers[i]->queued_blobs)
+          targets.push_back({queued.first, THFloatTensor_data(queued.second)});
+      if(!targets.empty() && !container->Inflate(targets))
+        std::cerr << "[WARN] Unable to read the model's weights" << std::endl;
+
+      for(int i = 0; i < n; ++i) {
+        for(auto& queued : layers[i]->queued_blobs)
+          THFloatTensor_free(queued.second);
+        layers[i]->queued_blobs.clear();
+        layers[i]->FinishParams(params[i].tensors, params[i].indices);
+      }
     }
 
     ~Model() {
       delete net_params;
+      delete container;
       for(Layer* layer : layers)
         delete layer;
     }
   private:
     caffe::NetParameter* net_params;
+    Container* container; // the weights' source, if not net_params itself
     std::vector<Layer*> layers;
+    std::vector<Layer*> root_layers;
     std::unordered_set<std::string> tips;
     std::vector<std::string> roots;
 };
 
-void loadModel(void** handle, const char* prototxt, const char* caffemodel) {
+caffe::NetParameter* ReadCaffemodel(const char* caffemodel) {
   int fd = open(caffemodel, O_RDONLY);
-  if(fd < 0) return;
+  if(fd < 0) return nullptr;
 
   ZeroCopyInputStream* raw_input = new FileInputStream(fd);
   CodedInputStream* coded_input = new CodedInputStream(raw_input);
@@ -160,10 +210,25 @@ void loadModel(void** handle, const char* prototxt, const char* caffemodel) {
   caffe::NetParameter* net_params = new caffe::NetParameter();
   bool loaded_caffemodel = net_params->ParseFromCodedStream(coded_input);
 
-  delete raw_input;
   delete coded_input;
+  delete raw_input;
   close(fd);
-  if(!loaded_caffemodel) return;
+  if(!loaded_caffemodel) {
+    delete net_params;
+    return nullptr;
+  }
+  return net_params;
+}
+
+void loadModel(void** handle, const char* prototxt, const char* caffemodel,
+               const LoadOptions* opts) {
+  caffe::NetParameter* net_params = nullptr;
+  Container* container = nullptr;
+  if(IsContainer(caffemodel))
+    container = Container::Open(caffemodel, &net_params);
+  else
+    net_params = ReadCaffemodel(caffemodel);
+  if(net_params == nullptr) return;
 
   // find and canonicalize input shape
   bool has_input_shape = false;
@@ -227,11 +292,19 @@ void loadModel(void** handle, const char* prototxt, const char* caffemodel) {
   canon_data_layer->set_name(data_layer_name);
   canon_data_layer->set_allocated_input_param(canon_input_param);
 
-  Model* model = new Model(net_params);
+  Model* model = new Model(net_params, *opts, container);
 
   handle[1] = model;
 }
 
+int compressModel(const char* caffemodel, const char* container) {
+  caffe::NetParameter* net_params = ReadCaffemodel(caffemodel);
+  if(net_params == nullptr) return 0;
+  bool written = WriteContainer(*net_params, container);
+  delete net_params;
+  return written;
+}
+
 void buildModel(const void** handle, const char* luafile) {
   Model* model = (Model*)handle[1];
   std::ofstream out(luafile);
@@ -239,12 +312,132 @@ void buildModel(const void** handle, const char* luafile) {
   out.close();
 }
 
-void getParams(const void** handle, THFloatTensor*** params) {
+void getParams(const void** handle, LayerParams* params, int num_layers) {
   Model* model = (Model*)handle[1];
-  model->Parameterize(params);
+  model->Parameterize(params, num_layers);
 }
 
 void freeModel(void** handle) {
   Model* model = (Model*)handle[1];
   delete model;
 }
+
+enum JobStatus { JOB_FAILED = -1, JOB_PENDING = 0, JOB_DONE = 1 };
+
+// Runs the stages of a model load (parse and build, then parameterize) on a
+// background thread, one stage at a time, so that lua can poll for them.
+class LoadJob {
+  public:
+    LoadJob(const char* prototxt, const char* caffemodel, const char* luafile,
+            const LoadOptions& opts)
+      : prototxt(prototxt), caffemodel(caffemodel), luafile(luafile), opts(opts),
+        status(JOB_DONE) {
+      handle[1] = nullptr;
+      Start([this]() {
+        loadModel(handle, this->prototxt.c_str(), this->caffemodel.c_str(), &this->opts);
+        if(handle[1] == nullptr)
+          return false;
+        buildModel((const void**)handle, this->luafile.c_str());
+        return true;
+      });
+    }
+
+    void Start(std::function<bool()> stage) {
+      Wait();
+      status = JOB_PENDING;
+      worker = std::thread([this, stage]() {
+        status = stage() ? JOB_DONE : JOB_FAILED;
+      });
+    }
+
+    int Poll() {
+      return status;
+    }
+
+    int Wait() {
+      if(worker.joinable())
+        worker.join();
+      return status;
+    }
+
+    // Copies lua's pointer arrays and takes a reference to every tensor in
+    // them, so that the parameterize stage never writes into tensors (or
+    // reads arrays) that lua has since collected.
+    void HoldParams(LayerParams* params, int num_layers) {
+      held_tensors.resize(num_layers);
+      held_indices.resize(num_layers);
+      held_params.resize(num_layers);
+      for(int i = 0; i < num_layers; ++i) {
+        auto& tensors = held_tensors[i];
+        auto& indices = held_indices[i];
+        tensors.assign(params[i].tensors, params[i].tensors + params[i].num_tensors);
+        indices.assign(params[i].indices, params[i].indices + params[i].num_indices);
+        for(THFloatTensor* tensor : tensors)
+          THFloatTensor_retain(tensor);
+        for(THIntTensor* index : indices)
+          THIntTensor_retain(index);
+        held_params[i] = {(int)tensors.size(), tensors.data(),
+                          (int)indices.size(), indices.data()};
+      }
+    }
+
+    void ReleaseParams() {
+      for(auto& tensors : held_tensors)
+        for(THFloatTensor* tensor : tensors)
+          THFloatTensor_free(tensor);
+      for(auto& indices : held_indices)
+        for(THIntTensor* index : indices)
+          THIntTensor_free(index);
+      held_tensors.clear();
+      held_indices.clear();
+      held_params.clear();
+    }
+
+    ~LoadJob() {
+      Wait();
+      ReleaseParams();
+      if(handle[1] != nullptr)
+        freeModel(handle);
+    }
+
+    void* handle[2];
+    std::vector<LayerParams> held_params;
+  private:
+    std::string prototxt;
+    std::string caffemodel;
+    std::string luafile;
+    LoadOptions opts;
+    std::vector<std::vector<THFloatTensor*>> held_tensors;
+    std::vector<std::vector<THIntTensor*>> held_indices;
+    std::atomic<int> status;
+    std::thread worker;
+};
+
+void* loadModelAsync(const char* prototxt, const char* caffemodel, const char* luafile,
+                     const LoadOptions* opts) {
+  return new LoadJob(prototxt, caffemodel, luafile, *opts);
+}
+
+void getParamsAsync(void* job, LayerParams* params, int num_layers) {
+  LoadJob* load_job = (LoadJob*)job;
+  load_job->Wait();
+  load_job->HoldParams(params, num_layers);
+  load_job->Start([load_job]() {
+    getParams((const void**)load_job->handle, load_job->held_params.data(),
+              load_job->held_params.size());
+    load_job->ReleaseParams();
+    return true;
+  });
+}
+
+int pollJob(void* job) {
+  return ((LoadJob*)job)->Poll();
+}
+
+int waitJob(void* job) {
+  return ((LoadJob*)job)->Wait();
+}
+
+void freeJob(void* job) {
+  delete (LoadJob*)job;
+}
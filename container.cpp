@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+#include "caffe.pb.h"
+#include "container.h"
+
+// Layout (host byte order):
+//   char[4] magic, uint32 version, uint64 net_bytes, NetParameter (no blob data),
+//   uint32 num_blocks, BlockHeader[num_blocks], compressed blocks
+
+static const char kMagic[4] = {'C', 'G', 'W', 'C'};
+static const uint32_t kVersion = 2;
+static const uint32_t kBlockFloats = 1 << 16; // 256KiB of weights per block
+
+// A process-wide pool shared by every load, so that concurrent (async) loads
+// together use at most hardware_concurrency() inflate threads, plus the
+// threads that asked for the work, which also take part in it.
+class ThreadPool {
+  public:
+    static ThreadPool& Shared() {
+      static ThreadPool pool;
+      return pool;
+    }
+
+    // runs fn(0) ... fn(n-1); false if any call failed
+    bool ParallelFor(int n, std::function<bool(int)> fn) {
+      if(n <= 1)
+        return n == 0 || fn(0);
+
+      auto work = std::make_shared<Work>();
+      work->n = n;
+      work->fn = fn;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        int helpers = std::min<int>(workers.size(), n - 1);
+        for(int i = 0; i < helpers; ++i)
+          tasks.push_back(work);
+      }
+      cv.notify_all();
+
+      Drain(*work);
+      std::unique_lock<std::mutex> lock(work->mutex);
+      work->done_cv.wait(lock, [&]() { return work->done == work->n; });
+      return work->ok;
+    }
+
+  private:
+    struct Work {
+      int n;
+      std::function<bool(int)> fn;
+      std::atomic<int> next{0};
+      std::atomic<bool> ok{true};
+      int done = 0;
+      std::mutex mutex;
+      std::condition_variable done_cv;
+    };
+
+    static void Drain(Work& work) {
+      for(int i = work.next++; i < work.n; i = work.next++) {
+        if(work.ok && !work.fn(i))
+          work.ok = false;
+        std::lock_guard<std::mutex> lock(work.mutex);
+        if(++work.done == work.n)
+          work.done_cv.notify_all();
+      }
+    }
+
+    ThreadPool() {
+      int num_threads = std::max(1u, std::thread::hardware_concurrency());
+      for(int t = 0; t < num_threads; ++t)
+        workers.emplace_back([this]() { Loop(); });
+    }
+
+    void Loop() {
+      while(true) {
+        std::shared_ptr<Work> work;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [this]() { return stop || !tasks.empty(); });
+          if(tasks.empty())
+            return;
+          work = tasks.front();
+          tasks.pop_front();
+        }
+        Drain(*work);
+      }
+    }
+
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      cv.notify_all();
+      for(auto& worker : workers)
+        worker.join();
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<Work>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+};
+
+// groups the i-th bytes of every float together, which deflates far better
+static void Shuffle(const float* src, int n, unsigned char* dest) {
+  const unsigned char* bytes = (const unsigned char*)src;
+  for(int i = 0; i < n; ++i)
+    for(int b = 0; b < sizeof(float); ++b)
+      dest[b*n + i] = bytes[i*sizeof(float) + b];
+}
+
+static void Unshuffle(const unsigned char* src, int n, float* dest) {
+  unsigned char* bytes = (unsigned char*)dest;
+  for(int i = 0; i < n; ++i)
+    for(int b = 0; b < sizeof(float); ++b)
+      bytes[i*sizeof(float) + b] = src[b*n + i];
+}
+
+static bool ReadAt(int fd, void* buf, size_t len, uint64_t offset) {
+  char* dest = (char*)buf;
+  while(len > 0) {
+    ssize_t nread = pread(fd, dest, len, offset);
+    if(nread <= 0) return false;
+    dest += nread;
+    len -= nread;
+    offset += nread;
+  }
+  return true;
+}
+
+// the number of floats blob's shape holds, or -1 if it is not a valid shape
+static long BlobCount(const caffe::BlobProto& blob) {
+  std::vector<long> dims;
+  if(blob.has_shape())
+    dims.assign(blob.shape().dim().begin(), blob.shape().dim().end());
+  else
+    dims = {blob.num(), blob.channels(), blob.height(), blob.width()};
+
+  long count = 1;
+  for(long dim : dims) {
+    if(dim < 0 || (dim > 0 && count > std::numeric_limits<long>::max() / dim))
+      return -1;
+    count *= dim;
+  }
+  return count;
+}
+
+bool IsContainer(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return false;
+  char magic[4];
+  bool is_container = ReadAt(fd, magic, sizeof(magic), 0) &&
+    memcmp(magic, kMagic, sizeof(magic)) == 0;
+  close(fd);
+  return is_container;
+}
+
+bool WriteContainer(const caffe::NetParameter& net_params, const char* path) {
+  caffe::NetParameter stripped(net_params);
+  std::vector<BlockHeader> blocks;
+  for(int l = 0; l < stripped.layer_size(); ++l) {
+    auto* layer = stripped.mutable_layer(l);
+    for(int b = 0; b < layer->blobs_size(); ++b) {
+      uint64_t num_elems = layer->blobs(b).data_size();
+      for(uint64_t off = 0; off < num_elems; off += kBlockFloats) {
+        BlockHeader block = {0, off, (uint32_t)l, (uint32_t)b,
+          (uint32_t)std::min<uint64_t>(kBlockFloats, num_elems - off), 0, 0, 0};
+        blocks.push_back(block);
+      }
+      layer->mutable_blobs(b)->clear_data();
+    }
+  }
+
+  std::string net_bytes;
+  if(!stripped.SerializeToString(&net_bytes)) return false;
+
+  std::vector<std::string> compressed(blocks.size());
+  bool ok = blocks.empty() || ThreadPool::Shared().ParallelFor(blocks.size(), [&](int i) {
+    BlockHeader& block = blocks[i];
+    const float* src = net_params.layer(block.layer).blobs(block.blob).data().data() +
+      block.elem_offset;
+    block.nnz = block.num_elems - std::count(src, src + block.num_elems, 0.f);
+
+    uLong raw_bytes = block.num_elems * sizeof(float);
+    std::vector<unsigned char> shuffled(raw_bytes);
+    Shuffle(src, block.num_elems, shuffled.data());
+
+    // inflate speed barely depends on the level, so this only trades
+    // write time against size
+    uLongf comp_bytes = compressBound(raw_bytes);
+    compressed[i].resize(comp_bytes);
+    if(compress2((Bytef*)&compressed[i][0], &comp_bytes, shuffled.data(), raw_bytes,
+                 Z_DEFAULT_COMPRESSION) != Z_OK)
+      return false;
+    compressed[i].resize(comp_bytes);
+    block.comp_bytes = comp_bytes;
+    return true;
+  });
+  if(!ok) return false;
+
+  uint64_t net_size = net_bytes.size();
+  uint32_t num_blocks = blocks.size();
+  uint64_t offset = sizeof(kMagic) + sizeof(kVersion) + sizeof(net_size) + net_size +
+    sizeof(num_blocks) + num_blocks * sizeof(BlockHeader);
+  for(auto& block : blocks) {
+    block.file_offset = offset;
+    offset += block.comp_bytes;
+  }
+
+  std::ofstream out(path, std::ios::binary);
+  out.write(kMagic, sizeof(kMagic));
+  out.write((const char*)&kVersion, sizeof(kVersion));
+  out.write((const char*)&net_size, sizeof(net_size));
+  out.write(net_bytes.data(), net_size);
+  out.write((const char*)&num_blocks, sizeof(num_blocks));
+  out.write((const char*)blocks.data(), num_blocks * sizeof(BlockHeader));
+  for(auto& block_data : compressed)
+    out.write(block_data.data(), block_data.size());
+  out.close();
+  return out.good();
+}
+
+Container* Container::Open(const char* path, caffe::NetParameter** net_params) {
+  *net_params = nullptr;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return nullptr;
+
+  // every size and offset read from the file is checked against its length
+  // (and the blobs' shapes) before use, so that a truncated or corrupt
+  // container fails to open instead of throwing or writing out of bounds
+  struct stat file_stat;
+  char magic[4];
+  uint32_t version;
+  uint64_t net_size;
+  uint64_t offset = 0;
+  bool read_header = fstat(fd, &file_stat) == 0 &&
+    ReadAt(fd, magic, sizeof(magic), offset) &&
+    ReadAt(fd, &version, sizeof(version), offset += sizeof(magic)) &&
+    ReadAt(fd, &net_size, sizeof(net_size), offset += sizeof(version));
+  offset += sizeof(net_size);
+  uint64_t file_size = file_stat.st_size;
+  if(!read_header || memcmp(magic, kMagic, sizeof(magic)) != 0 || version != kVersion ||
+     net_size > file_size - offset) {
+    close(fd);
+    return nullptr;
+  }
+
+  Container* container = new Container(fd);
+  caffe::NetParameter* net = new caffe::NetParameter();
+  std::string net_bytes(net_size, '\0');
+  uint32_t num_blocks;
+  bool read_net = ReadAt(fd, &net_bytes[0], net_size, offset) &&
+    net->ParseFromString(net_bytes) &&
+    ReadAt(fd, &num_blocks, sizeof(num_blocks), offset += net_size);
+  offset += sizeof(num_blocks);
+  read_net = read_net && num_blocks <= (file_size - offset) / sizeof(BlockHeader);
+
+  auto& blocks = container->blocks;
+  blocks.resize(read_net ? num_blocks : 0);
+  read_net = read_net &&
+    ReadAt(fd, blocks.data(), num_blocks * sizeof(BlockHeader), offset);
+
+  // index the blocks by blob; the blobs themselves stay empty
+  for(int i = 0; read_net && i < blocks.size(); ++i) {
+    BlockHeader& block = blocks[i];
+    if(block.layer >= net->layer_size() ||
+       block.blob >= net->layer(block.layer).blobs_size() ||
+       block.num_elems > kBlockFloats ||
+       block.file_offset > file_size || block.comp_bytes > file_size - block.file_offset) {
+      read_net = false;
+      break;
+    }
+    const caffe::BlobProto& blob = net->layer(block.layer).blobs(block.blob);
+    long count = BlobCount(blob);
+    if(count < 0 || block.elem_offset > count || block.num_elems > count - block.elem_offset) {
+      read_net = false;
+      break;
+    }
+    auto& blob_blocks = container->blob_blocks[&blob];
+    blob_blocks.blocks.push_back(i);
+    blob_blocks.size = count;
+    blob_blocks.nnz += block.nnz;
+  }
+  if(!read_net) {
+    delete net;
+    delete container;
+    return nullptr;
+  }
+
+  *net_params = net;
+  return container;
+}
+
+Container::~Container() {
+  close(fd);
+}
+
+bool Container::Contains(const caffe::BlobProto& blob) const {
+  return blob_blocks.count(&blob) > 0;
+}
+
+long Container::Size(const caffe::BlobProto& blob) const {
+  return blob_blocks.at(&blob).size;
+}
+
+long Container::CountNonzero(const caffe::BlobProto& blob) const {
+  return blob_blocks.at(&blob).nnz;
+}
+
+bool Container::Inflate(const std::vector<Target>& targets) const {
+  std::vector<std::pair<int, float*>> work;
+  for(auto& target : targets)
+    for(int block : blob_blocks.at(target.blob).blocks)
+      work.emplace_back(block, target.dest);
+  // read in file order
+  std::sort(work.begin(), work.end(), [this](const std::pair<int, float*>& a,
+                                             const std::pair<int, float*>& b) {
+    return blocks[a.first].file_offset < blocks[b.first].file_offset;
+  });
+
+  return ThreadPool::Shared().ParallelFor(work.size(), [&](int i) {
+    const BlockHeader& block = blocks[work[i].first];
+    std::vector<unsigned char> comp(block.comp_bytes);
+    if(!ReadAt(fd, comp.data(), block.comp_bytes, block.file_offset))
+      return false;
+
+    uLongf raw_bytes = block.num_elems * sizeof(float);
+    std::vector<unsigned char> shuffled(raw_bytes);
+    if(uncompress(shuffled.data(), &raw_bytes, comp.data(), block.comp_bytes) != Z_OK ||
+       raw_bytes != block.num_elems * sizeof(float))
+      return false;
+    Unshuffle(shuffled.data(), block.num_elems, work[i].second + block.elem_offset);
+    return true;
+  });
+}
+
+bool Container::Inflate(const caffe::BlobProto& blob, float* dest) const {
+  return Inflate(std::vector<Target>(1, Target{&blob, dest}));
+}
@@ -0,0 +1,59 @@
+#ifndef CONTAINER_H_
+#define CONTAINER_H_
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// A block-compressed alternative to the caffemodel: the NetParameter with its
+// blob data stripped, followed by the blob data split into independently
+// deflated blocks. The blobs of a loaded container stay empty; the blocks of
+// the whole model are inflated in parallel straight into the tensors when its
+// parameters are filled.
+
+struct BlockHeader {
+  uint64_t file_offset;
+  uint64_t elem_offset;
+  uint32_t layer;
+  uint32_t blob;
+  uint32_t num_elems;
+  uint32_t comp_bytes;
+  uint32_t nnz;
+  uint32_t unused;
+};
+
+class Container {
+  public:
+    // reads the net and the block index of the container at path
+    static Container* Open(const char* path, caffe::NetParameter** net_params);
+    ~Container();
+
+    bool Contains(const caffe::BlobProto& blob) const;
+    long Size(const caffe::BlobProto& blob) const;
+    long CountNonzero(const caffe::BlobProto& blob) const;
+    // a blob to inflate, into dest, which holds Size(blob) floats
+    struct Target {
+      const caffe::BlobProto* blob;
+      float* dest;
+    };
+    // inflates the blocks of every target, all of them in parallel
+    bool Inflate(const std::vector<Target>& targets) const;
+    bool Inflate(const caffe::BlobProto& blob, float* dest) const;
+
+  private:
+    struct BlobBlocks {
+      std::vector<int> blocks;
+      long size = 0;
+      long nnz = 0;
+    };
+
+    Container(int fd) : fd(fd) {}
+    int fd;
+    std::vector<BlockHeader> blocks;
+    std::unordered_map<const caffe::BlobProto*, BlobBlocks> blob_blocks;
+};
+
+bool IsContainer(const char* path);
+bool WriteContainer(const caffe::NetParameter& net_params, const char* path);
+
+#endif
@@ -5,58 +5,221 @@ caffegraph = {}
 
 ffi.cdef[[
 struct params { int num_params; THFloatTensor** params; };
-void loadModel(void** handle, const char* prototxt, const char* caffemodel);
+typedef struct { float sparsity_threshold; } LoadOptions;
+typedef struct {
+  int num_tensors; THFloatTensor** tensors;
+  int num_indices; THIntTensor** indices;
+} LayerParams;
+void loadModel(void** handle, const char* prototxt, const char* caffemodel,
+               const LoadOptions* opts);
 void buildModel(void** handle, const char* lua_path);
-void getParams(void** handle, THFloatTensor*** params);
+void getParams(void** handle, LayerParams* params, int num_layers);
 void freeModel(void** handle);
+int compressModel(const char* caffemodel, const char* container);
+void* loadModelAsync(const char* prototxt, const char* caffemodel, const char* lua_path,
+                     const LoadOptions* opts);
+void getParamsAsync(void* job, LayerParams* params, int num_layers);
+int pollJob(void* job);
+int waitJob(void* job);
+void freeJob(void* job);
+void csrmm(int transpose, int rows, int n, const int* row_ptr, const int* col_idx,
+           const float* values, const float* dense, float* out);
+void csrgrad(int rows, int n, const int* row_ptr, const int* col_idx,
+             const float* grad_out, const float* input, float scale, float* grad_values);
 ]]
 
 caffegraph.C = ffi.load(package.searchpath('libcaffegraph', package.cpath))
 
-caffegraph.load = function(prototxt, caffemodel)
-  local handle = ffi.new('void*[1]')
+require 'caffegraph.CSRModule'
+require 'caffegraph.CSRLinear'
+require 'caffegraph.CSRSpatialConvolution'
 
-  -- load the caffemodel into a graph structure
-  local initHandle = handle[1]
-  caffegraph.C.loadModel(handle, prototxt, caffemodel)
-  if handle[1] == initHandle then
-    error('Unable to load model.')
+-- opts: sparsityThreshold, the fraction of zero weights above which
+-- InnerProduct and Convolution weights are stored sparsely (default: never)
+local function loadOptions(opts)
+  opts = opts or {}
+  return ffi.new('LoadOptions', {opts.sparsityThreshold or 0})
+end
+
+-- Points every weight and bias in modmap into one flat storage, and every
+-- gradient into another. getParams then fills the flat storage in place
+-- through the per-module tensors, which are views into it. The storages are
+-- allocated by TH, which aligns large allocations to 64 bytes.
+-- params and gradParams are allocated while the tensors the modules'
+-- constructors made are still alive, so memory briefly peaks at about twice
+-- the model; set() drops each old storage as it is replaced. Only the copy
+-- that model:getParameters() would make is avoided, and calling it would
+-- copy everything into new storages again.
+local function flattenParams(modmap)
+  local numParams = 0
+  for _,nodes in ipairs(modmap) do
+    for i=1,#nodes do
+      local module = nodes[i].data.module
+      module:float()
+      if module.weight then numParams = numParams + module.weight:nElement() end
+      if module.bias then numParams = numParams + module.bias:nElement() end
+    end
   end
 
-  -- serialize the graph and write it out
-  local luaModel = path.splitext(caffemodel)
-  luaModel = luaModel..'.lua'
-  caffegraph.C.buildModel(handle, luaModel)
+  local params = torch.FloatTensor(numParams):zero()
+  local gradParams = torch.FloatTensor(numParams):zero()
+  if numParams == 0 then
+    return params, gradParams
+  end
 
-  -- -- bring the model into lua world
-  local model, modmap = dofile(luaModel)
+  local offset = 1
+  local function place(module, key, gradKey)
+    local tensor = module[key]
+    if not tensor then return end
+    local size = tensor:size()
+    tensor:set(params:storage(), offset, size)
+    if module[gradKey] then
+      module[gradKey]:set(gradParams:storage(), offset, size)
+    end
+    offset = offset + tensor:nElement()
+  end
 
-  -- transfer the parameters
-  local noData = torch.FloatTensor():zero():cdata()
-  local module_params = {}
+  for _,nodes in ipairs(modmap) do
+    for i=1,#nodes do
+      local module = nodes[i].data.module
+      place(module, 'weight', 'gradWeight')
+      place(module, 'bias', 'gradBias')
+    end
+  end
+  return params, gradParams
+end
+
+-- maps each node in modmap to its (weight, bias) tensors, and each sparse
+-- node to its (rowPtr, colIdx) indices, for getParams
+local function bindParams(modmap)
+  local noData = torch.FloatTensor():zero()
+  local arrays = {}
+  local cParams = ffi.new('LayerParams[?]', math.max(#modmap, 1))
   for i,nodes in ipairs(modmap) do
     local params = {}
     for i=1,#nodes do
       local module = nodes[i].data.module
-      module:float()
       if torch.isTypeOf(module, nn.BatchNormalization) then
         module.weight:fill(1)
         module.bias:zero()
         params[(i-1)*2+1] = module.running_mean:cdata()
         params[i*2] = module.running_var:cdata()
       else
-        params[(i-1)*2+1] = module.weight and module.weight:cdata() or noData
-        params[i*2] = module.bias and module.bias:cdata() or noData
+        params[(i-1)*2+1] = module.weight and module.weight:cdata() or noData:cdata()
+        params[i*2] = module.bias and module.bias:cdata() or noData:cdata()
+      end
+    end
+    local indices = {}
+    for i=1,#nodes do
+      local module = nodes[i].data.module
+      if module.rowPtr then
+        indices[#indices+1] = module.rowPtr:cdata()
+        indices[#indices+1] = module.colIdx:cdata()
       end
     end
-    module_params[i] = ffi.new('THFloatTensor*['..#params..']', params)
+
+    local tensorArray = ffi.new('THFloatTensor*[?]', #params, params)
+    local indexArray = ffi.new('THIntTensor*[?]', #indices, indices)
+    cParams[i-1].num_tensors = #params
+    cParams[i-1].tensors = tensorArray
+    cParams[i-1].num_indices = #indices
+    cParams[i-1].indices = indexArray
+    arrays[#arrays+1] = tensorArray
+    arrays[#arrays+1] = indexArray
+  end
+  -- the pointer arrays must outlive getParams (getParamsAsync copies them)
+  return cParams, {noData, arrays}
+end
+
+local function luaModelPath(caffemodel)
+  local luaModel = path.splitext(caffemodel)
+  return luaModel..'.lua'
+end
+
+caffegraph.load = function(prototxt, caffemodel, opts)
+  local handle = ffi.new('void*[1]')
+
+  -- load the caffemodel into a graph structure
+  local initHandle = handle[1]
+  caffegraph.C.loadModel(handle, prototxt, caffemodel, loadOptions(opts))
+  if handle[1] == initHandle then
+    error('Unable to load model.')
   end
-  local cParams = ffi.new('THFloatTensor**['..#module_params..']', module_params)
-  caffegraph.C.getParams(handle, cParams)
+
+  -- serialize the graph and write it out
+  local luaModel = luaModelPath(caffemodel)
+  caffegraph.C.buildModel(handle, luaModel)
+
+  -- -- bring the model into lua world
+  local model, modmap, inputSizes = dofile(luaModel)
+
+  -- transfer the parameters
+  local params, gradParams = flattenParams(modmap)
+  local cParams, paramRefs = bindParams(modmap)
+  caffegraph.C.getParams(handle, cParams, #modmap)
 
   caffegraph.C.freeModel(handle)
 
-  return model
+  return model, inputSizes, params, gradParams
+end
+
+-- Writes the weights of a caffemodel into a block-compressed container,
+-- which can be passed to load in place of the caffemodel.
+caffegraph.compress = function(caffemodel, container)
+  if caffegraph.C.compressModel(caffemodel, container) == 0 then
+    error('Unable to compress model.')
+  end
+end
+
+local AsyncLoad = {}
+AsyncLoad.__index = AsyncLoad
+
+-- Starts loading a model on background threads and returns a handle.
+-- Parsing and graph building, then weight conversion, run off the lua
+-- thread; only the generated model file is run by lua, from ready/wait.
+caffegraph.loadAsync = function(prototxt, caffemodel, opts)
+  local job = caffegraph.C.loadModelAsync(prototxt, caffemodel, luaModelPath(caffemodel),
+                                          loadOptions(opts))
+  return setmetatable({job = ffi.gc(job, caffegraph.C.freeJob), stage = 'build',
+                       luaModel = luaModelPath(caffemodel)}, AsyncLoad)
+end
+
+function AsyncLoad:advance(block)
+  local C = caffegraph.C
+  while self.stage ~= 'done' do
+    local status = block and C.waitJob(self.job) or C.pollJob(self.job)
+    if status == 0 then
+      return false
+    elseif status < 0 then
+      error('Unable to load model.')
+    end
+
+    if self.stage == 'build' then
+      local model, modmap, inputSizes = dofile(self.luaModel)
+      self.model, self.inputSizes = model, inputSizes
+      self.params, self.gradParams = flattenParams(modmap)
+      -- the job takes its own references to the tensors in cParams
+      local cParams, paramRefs = bindParams(modmap)
+      C.getParamsAsync(self.job, cParams, #modmap)
+      self.stage = 'params'
+    else
+      C.freeJob(ffi.gc(self.job, nil))
+      self.job = nil
+      self.stage = 'done'
+    end
+  end
+  return true
+end
+
+-- returns true once the model is loaded, without blocking
+function AsyncLoad:ready()
+  return self:advance(false)
+end
+
+-- blocks until the model is loaded and returns it like caffegraph.load
+function AsyncLoad:wait()
+  self:advance(true)
+  return self.model, self.inputSizes, self.params, self.gradParams
 end
 
 return caffegraph
@@ -6,12 +6,14 @@
 #include <cstdarg>
 
 #include "caffe.pb.h"
+#include "container.h"
 #include "layers.h"
 
 #define LayerInit(NAME)                                                 \
   NAME ## Layer::NAME ## Layer(const caffe::LayerParameter& params,     \
-      std::vector<Layer*> inputs)                                       \
-    : Layer(params, inputs)
+      std::vector<Layer*> inputs, const LoadOptions& opts,              \
+      const Container* container)                                       \
+    : Layer(params, inputs, opts, container)
 
 #define print(VAL) std::cout << VAL << std::endl; // DEBUGGING
 
@@ -25,71 +27,158 @@ void RepVec(std::vector<T>& vec, int len) {
     vec.push_back(fill);
 }
 
-void THCopy(const caffe::BlobProto& src, THFloatTensor* dest) {
-  auto& blob_shape = src.shape();
-  int num_cpy = 1;
-  for(int dim : blob_shape.dim()) num_cpy *= dim;
-
+void THCopyRange(const float* src_data, int offset, int num_cpy, THFloatTensor* dest) {
   dest = THFloatTensor_newContiguous(dest);
   assert(THFloatTensor_numel(dest) == num_cpy);
-  memcpy(THFloatTensor_data(dest), src.data().data(), sizeof(float)*num_cpy);
+  memcpy(THFloatTensor_data(dest), src_data + offset, sizeof(float)*num_cpy);
+  THFloatTensor_free(dest);
+}
+
+void THCopyTransposed(const float* src_data, THFloatTensor* dest,
+                      int rows, int cols, int inner) {
+  // copies src viewed as (rows, cols, inner) into dest as (cols, rows, inner)
+  dest = THFloatTensor_newContiguous(dest);
+  assert(THFloatTensor_numel(dest) == rows*cols*inner);
+  float* dest_data = THFloatTensor_data(dest);
+  for(int r = 0; r < rows; ++r)
+    for(int c = 0; c < cols; ++c)
+      memcpy(dest_data + (c*rows + r)*inner, src_data + (r*cols + c)*inner,
+             sizeof(float)*inner);
   THFloatTensor_free(dest);
 }
 
+void THCopyCSR(const float* src_data, long numel, int rows, THFloatTensor* values,
+               THIntTensor* row_ptr, THIntTensor* col_idx) {
+  // copies src viewed as a (rows, numel/rows) matrix into compressed sparse rows
+  int cols = numel / rows;
+
+  values = THFloatTensor_newContiguous(values);
+  row_ptr = THIntTensor_newContiguous(row_ptr);
+  col_idx = THIntTensor_newContiguous(col_idx);
+  float* values_data = THFloatTensor_data(values);
+  int* row_ptr_data = THIntTensor_data(row_ptr);
+  int* col_idx_data = THIntTensor_data(col_idx);
+
+  int nnz = 0;
+  for(int r = 0; r < rows; ++r) {
+    row_ptr_data[r] = nnz;
+    for(int c = 0; c < cols; ++c) {
+      float val = src_data[r*cols + c];
+      if(val == 0)
+        continue;
+      values_data[nnz] = val;
+      col_idx_data[nnz] = c;
+      ++nnz;
+    }
+  }
+  row_ptr_data[rows] = nnz;
+  assert(THFloatTensor_numel(values) == nnz);
+
+  THFloatTensor_free(values);
+  THIntTensor_free(row_ptr);
+  THIntTensor_free(col_idx);
+}
+
 Layer* Layer::MakeLayer(const caffe::LayerParameter& params,
-                        std::vector<Layer*> inputs) {
+                        std::vector<Layer*> inputs, const LoadOptions& opts,
+                        const Container* container) {
   if(params.type() == "Data")
-    return new DataLayer(params, inputs);
+    return new DataLayer(params, inputs, opts, container);
   else if(params.type() == "Convolution")
-    return new ConvolutionLayer(params, inputs);
+    return new ConvolutionLayer(params, inputs, opts, container);
   else if(params.type() == "Pooling")
-    return new PoolingLayer(params, inputs);
+    return new PoolingLayer(params, inputs, opts, container);
   else if(params.type() == "BatchNorm")
-    return new BatchNormLayer(params, inputs);
+    return new BatchNormLayer(params, inputs, opts, container);
   else if(params.type() == "InnerProduct")
-    return new InnerProductLayer(params, inputs);
+    return new InnerProductLayer(params, inputs, opts, container);
   else if(params.type() == "Eltwise")
-    return new EltwiseLayer(params, inputs);
+    return new EltwiseLayer(params, inputs, opts, container);
   else if(params.type() == "Concat")
-    return new ConcatLayer(params, inputs);
+    return new ConcatLayer(params, inputs, opts, container);
   else if(params.type() == "Slice")
-    return new SliceLayer(params, inputs);
+    return new SliceLayer(params, inputs, opts, container);
   else if(params.type() == "Scale")
-    return new ScaleLayer(params, inputs);
+    return new ScaleLayer(params, inputs, opts, container);
   else if(params.type() == "ReLU")
-    return new ReLULayer(params, inputs);
+    return new ReLULayer(params, inputs, opts, container);
   else if(params.type() == "Sigmoid" || params.type() == "SigmoidCrossEntropyLoss")
-    return new SigmoidLayer(params, inputs);
+    return new SigmoidLayer(params, inputs, opts, container);
   else if(params.type() == "Tanh")
-    return new TanhLayer(params, inputs);
+    return new TanhLayer(params, inputs, opts, container);
   else if(params.type() == "Dropout")
-    return new DropoutLayer(params, inputs);
+    return new DropoutLayer(params, inputs, opts, container);
   else if(params.type() == "Softmax" || params.type() == "SoftmaxWithLoss")
-    return new SoftmaxLayer(params, inputs);
+    return new SoftmaxLayer(params, inputs, opts, container);
   else if(params.type() == "EuclideanLoss")
-    return new EuclideanLossLayer(params, inputs);
+    return new EuclideanLossLayer(params, inputs, opts, container);
   else if(params.type() == "Input")
-    return new InputLayer(params, inputs);
+    return new InputLayer(params, inputs, opts, container);
   else {
     std::cerr << "[WARN] No conversion for layer: " << params.type() << std::endl;
-    return new Layer(params, inputs);
+    return new Layer(params, inputs, opts, container);
   }
 
 }
 
-Layer::Layer(const caffe::LayerParameter& params, std::vector<Layer*> inputs)
-   : params(params), inputs(inputs) {
+Layer::Layer(const caffe::LayerParameter& params, std::vector<Layer*> inputs,
+             const LoadOptions& opts, const Container* container)
+   : params(params), inputs(inputs), opts(opts), container(container) {
   name = params.name();
   std::replace(name.begin(), name.end(), '/', '_');
 }
 
+long Layer::BlobSize(const caffe::BlobProto& blob) {
+  if(container != nullptr && container->Contains(blob))
+    return container->Size(blob);
+  return blob.data_size();
+}
+
+void Layer::CopyBlob(const caffe::BlobProto& blob, THFloatTensor* dest) {
+  long num_cpy = BlobSize(blob);
+  dest = THFloatTensor_newContiguous(dest);
+  assert(THFloatTensor_numel(dest) == num_cpy);
+  if(container != nullptr && container->Contains(blob)) {
+    queued_blobs.emplace_back(&blob, dest);
+    return;
+  }
+  memcpy(THFloatTensor_data(dest), blob.data().data(), sizeof(float)*num_cpy);
+  THFloatTensor_free(dest);
+}
+
+const float* Layer::BlobData(const caffe::BlobProto& blob, std::vector<float>& buffer) {
+  if(container == nullptr || !container->Contains(blob))
+    return blob.data().data();
+  buffer.resize(BlobSize(blob));
+  if(!container->Inflate(blob, buffer.data()))
+    std::cerr << "[WARN] Unable to read weights for layer \"" << name << "\"" << std::endl;
+  return buffer.data();
+}
+
+bool Layer::StoreSparse(const caffe::BlobProto& weight, int* nnz) {
+  *nnz = 0;
+  long size = BlobSize(weight);
+  if(opts.sparsity_threshold <= 0 || size == 0)
+    return false;
+  if(container != nullptr && container->Contains(weight)) {
+    *nnz = container->CountNonzero(weight);
+  } else {
+    for(float val : weight.data())
+      if(val != 0) ++*nnz;
+  }
+  float sparsity = 1 - (float)*nnz / size;
+  return *nnz > 0 && sparsity >= opts.sparsity_threshold;
+}
+
 std::vector<modstrs> Layer::layer_strs() {
   if(lua_layers.size() == 0)
     lua_layers.emplace_back(name, "nn.Identity()() -- ", params.type());
   return lua_layers;
 }
 
-void Layer::Parameterize(THFloatTensor** params) {}
+void Layer::Parameterize(THFloatTensor** tensors, THIntTensor** indices) {}
+
+void Layer::FinishParams(THFloatTensor** tensors, THIntTensor** indices) {}
 
 LayerInit(Data) {
   auto& input_param = params.input_param();
@@ -109,7 +198,7 @@ std::vector<std::vector<int>> Layer::GetOutputSizes() {
 
 LayerInit(Convolution) {
   auto& conv_params = params.convolution_param();
-  int groups = conv_params.group() == 0 ? 1 : conv_params.group();
+  groups = conv_params.group() == 0 ? 1 : conv_params.group();
   auto& weight = params.blobs(0);
   nInputPlane = weight.shape().dim(1) * groups;
   nOutputPlane = conv_params.num_output();
@@ -136,6 +225,68 @@ LayerInit(Convolution) {
     RepVec(d, dim-1);
   }
 
+  // one input plane per group: a depthwise convolution
+  depthwise = groups > 1 && groups == nInputPlane && k.size() == 2;
+
+  sparse = groups == 1 && k.size() == 2 && StoreSparse(weight, &nnz);
+
+  if(sparse) {
+    std::ostringstream module_os;
+    module_os << "nn.CSRSpatialConvolution(" << nInputPlane << ", " << nOutputPlane;
+    for(int ks : k) module_os << ", " << ks;
+    for(int ds : d) module_os << ", " << ds;
+    for(int ps : p) module_os << ", " << ps;
+    module_os << ", " << nnz << ")";
+    lua_layers.emplace_back(name, module_os.str(), inputs[0]->name);
+  } else if(groups == 1) {
+    lua_layers.emplace_back(name, ConvModule(nInputPlane, nOutputPlane), inputs[0]->name);
+  } else if(depthwise) {
+    std::ostringstream module_os;
+    module_os << "nn.SpatialDepthWiseConvolution(" << nInputPlane << ", "
+      << nOutputPlane / nInputPlane;
+    for(int ks : k) module_os << ", " << ks;
+    for(int ds : d) module_os << ", " << ds;
+    for(int ps : p) module_os << ", " << ps;
+    module_os << ")";
+    lua_layers.emplace_back(name, module_os.str(), inputs[0]->name);
+  } else {
+    // narrow each group's input planes, convolve, and join along the planes
+    int groupInputs = nInputPlane / groups;
+    int channelDim = -(int)k.size() - 1; // counted from the end so batches work
+
+    std::string module = ConvModule(groupInputs, nOutputPlane / groups);
+    std::ostringstream join_args_os;
+    join_args_os << "{";
+    for(int g = 0; g < groups; ++g) {
+      std::ostringstream narrow_name_os, conv_name_os, narrow_os;
+      narrow_name_os << name << "_in" << g+1;
+      conv_name_os << name << "_group" << g+1;
+      narrow_os << "nn.Narrow(" << channelDim << ", " << g*groupInputs + 1
+        << ", " << groupInputs << ")";
+
+      lua_layers.emplace_back(narrow_name_os.str(), narrow_os.str(), inputs[0]->name);
+      lua_layers.emplace_back(conv_name_os.str(), module, narrow_name_os.str());
+
+      join_args_os << conv_name_os.str();
+      if(g < groups-1)
+        join_args_os << ", ";
+    }
+    join_args_os << "}";
+
+    std::ostringstream join_os;
+    join_os << "nn.JoinTable(1, " << k.size() + 1 << ")";
+    lua_layers.emplace_back(name, join_os.str(), join_args_os.str());
+  }
+
+  std::vector<int> input_size = inputs[0]->GetOutputSizes()[0];
+  std::vector<int> output_size(input_size.size());
+  output_size[0] = nOutputPlane;
+  for(int i = 0; i < k.size(); ++i)
+    output_size[i+1] = (input_size[i+1] + 2*p[i] - k[i]) / d[i] + 1;
+  output_sizes.push_back(output_size);
+}
+
+std::string ConvolutionLayer::ConvModule(int nIn, int nOut) {
   std::ostringstream module_os;
   if(k.size() == 1) {
     module_os << "nn.TemporalConvolution(";
@@ -144,28 +295,61 @@ LayerInit(Convolution) {
   } else {
     module_os << "nn.VolumetricConvolution(";
   }
-  module_os << nInputPlane << ", " << nOutputPlane;
+  module_os << nIn << ", " << nOut;
   for(int ks : k) module_os << ", " << ks;
   for(int ds : d) module_os << ", " << ds;
   for(int ps : p) module_os << ", " << ps;
   module_os << ")";
-
-  lua_layers.emplace_back(name, module_os.str(), inputs[0]->name);
-
-  std::vector<int> input_size = inputs[0]->GetOutputSizes()[0];
-  std::vector<int> output_size(input_size.size());
-  output_size[0] = nOutputPlane;
-  for(int i = 0; i < k.size(); ++i)
-    output_size[i+1] = (input_size[i+1] + 2*p[i] - k[i]) / d[i] + 1;
-  output_sizes.push_back(output_size);
+  return module_os.str();
 }
 
-void ConvolutionLayer::Parameterize(THFloatTensor** tensors) {
+void ConvolutionLayer::Parameterize(THFloatTensor** tensors, THIntTensor** indices) {
   auto& conv_params = params.convolution_param();
-  for(int i = 0; i < params.blobs_size(); ++i)
-    THCopy(params.blobs(i), tensors[i]);
-  if(!conv_params.bias_term())
-    THFloatTensor_zero(tensors[1]);
+  bool has_bias = conv_params.bias_term() && params.blobs_size() > 1;
+  std::vector<float> buffer;
+
+  if(sparse) {
+    // tensors: values, bias; indices: row_ptr, col_idx
+    THCopyCSR(BlobData(params.blobs(0), buffer), BlobSize(params.blobs(0)), nOutputPlane,
+              tensors[0], indices[0], indices[1]);
+    if(has_bias)
+      CopyBlob(params.blobs(1), tensors[1]);
+    else
+      THFloatTensor_zero(tensors[1]);
+  } else if(groups == 1) {
+    for(int i = 0; i < params.blobs_size(); ++i)
+      CopyBlob(params.blobs(i), tensors[i]);
+    if(!has_bias)
+      THFloatTensor_zero(tensors[1]);
+  } else if(depthwise) {
+    // caffe orders output planes as (input plane, multiplier), torch as
+    // (multiplier, input plane)
+    int multiplier = nOutputPlane / nInputPlane;
+    int kernel_size = THFloatTensor_numel(tensors[0]) / nOutputPlane;
+    THCopyTransposed(BlobData(params.blobs(0), buffer), tensors[0],
+                     nInputPlane, multiplier, kernel_size);
+    if(has_bias)
+      THCopyTransposed(BlobData(params.blobs(1), buffer), tensors[1],
+                       nInputPlane, multiplier, 1);
+    else
+      THFloatTensor_zero(tensors[1]);
+  } else {
+    // tensors: (narrow, conv) pairs for each group, then the join
+    int group_outputs = nOutputPlane / groups;
+    int group_weights = BlobSize(params.blobs(0)) / groups;
+    std::vector<float> bias_buffer;
+    const float* weight_data = BlobData(params.blobs(0), buffer);
+    const float* bias_data = has_bias ? BlobData(params.blobs(1), bias_buffer) : nullptr;
+    for(int g = 0; g < groups; ++g) {
+      THFloatTensor* weight = tensors[(2*g+1)*2];
+      THFloatTensor* bias = tensors[(2*g+1)*2 + 1];
+      THCopyRange(weight_data, g*group_weights, group_weights, weight);
+      if(has_bias)
+        THCopyRange(bias_data, g*group_outputs, group_outputs, bias);
+      else
+        THFloatTensor_zero(bias);
+    }
+  }
 }
 
 LayerInit(Pooling) {
@@ -235,13 +419,19 @@ LayerInit(BatchNorm) {
   lua_layers.emplace_back(name, module_os.str(), inputs[0]->name);
 }
 
-void BatchNormLayer::Parameterize(THFloatTensor** tensors) {
-  THCopy(params.blobs(0), tensors[0]); // mean
-  THCopy(params.blobs(1), tensors[1]); // var
+void BatchNormLayer::Parameterize(THFloatTensor** tensors, THIntTensor** indices) {
+  CopyBlob(params.blobs(0), tensors[0]); // mean
+  CopyBlob(params.blobs(1), tensors[1]); // var
+  scale_factor = THFloatTensor_newWithSize1d(BlobSize(params.blobs(2)));
+  CopyBlob(params.blobs(2), scale_factor);
+}
 
-  float runningScale = 1 / params.blobs(2).data(0);
+void BatchNormLayer::FinishParams(THFloatTensor** tensors, THIntTensor** indices) {
+  float runningScale = 1 / THFloatTensor_data(scale_factor)[0];
   THFloatTensor_mul(tensors[0], tensors[0], runningScale);
   THFloatTensor_mul(tensors[1], tensors[1], runningScale);
+  THFloatTensor_free(scale_factor);
+  scale_factor = nullptr;
 }
 
 LayerInit(InnerProduct) {
@@ -259,14 +449,30 @@ LayerInit(InnerProduct) {
   std::vector<int> output_size(1, nOutputs);
   output_sizes.push_back(output_size);
 
+  sparse = StoreSparse(params.blobs(0), &nnz);
+
   std::ostringstream module_os;
-  module_os << "nn.Linear(" << nInputs << ", " << nOutputs << ")";
+  if(sparse)
+    module_os << "nn.CSRLinear(" << nInputs << ", " << nOutputs << ", " << nnz << ")";
+  else
+    module_os << "nn.Linear(" << nInputs << ", " << nOutputs << ")";
   lua_layers.emplace_back(name, module_os.str(), "collapse");
 }
 
-void InnerProductLayer::Parameterize(THFloatTensor** tensors) {
+void InnerProductLayer::Parameterize(THFloatTensor** tensors, THIntTensor** indices) {
+  // +2 because view has no params
+  if(sparse) {
+    // tensors: ..., values, bias; indices: row_ptr, col_idx
+    int nOutputs = params.inner_product_param().num_output();
+    std::vector<float> buffer;
+    THCopyCSR(BlobData(params.blobs(0), buffer), BlobSize(params.blobs(0)), nOutputs,
+              tensors[2], indices[0], indices[1]);
+    if(params.blobs_size() > 1)
+      CopyBlob(params.blobs(1), tensors[3]);
+    return;
+  }
   for(int i = 0; i < params.blobs_size(); ++i)
-    THCopy(params.blobs(i), tensors[i+2]); // +2 because view has no params
+    CopyBlob(params.blobs(i), tensors[i+2]);
 }
 
 LayerInit(Eltwise) {
@@ -375,28 +581,35 @@ LayerInit(Scale) {
     scale_modname.append("_scale");
     lua_layers.emplace_back(scale_modname, cmul_os.str(), input_name);
 
-    lua_layers.emplace_back(name, "nn.Add(1)", scale_modname);
+    // sized up front so that the bias can live in the flat parameter storage
+    std::ostringstream add_os;
+    add_os << "nn.Add(torch.LongStorage({";
+    for(int i = 0; i < input_size.size(); ++i) {
+      add_os << input_size[i];
+      if(i < input_size.size()-1)
+        add_os << ", ";
+    }
+    add_os << "}))";
+    lua_layers.emplace_back(name, add_os.str(), scale_modname);
   } else {
     lua_layers.emplace_back(name, cmul_os.str(), input_name);
   }
 }
 
-void THCopyAxis(const caffe::BlobProto& src, THFloatTensor* dest,
+void THCopyAxis(THFloatTensor* vec, THFloatTensor* dest,
                 std::vector<int> size, int axis) {
-  // effectively: dest:resize(size):copy(src:vecAlongDim(axis):expandAs(size))
+  // effectively: dest:resize(size):copy(vec:vecAlongDim(axis):expandAs(size))
   int ndim = size.size();
   std::vector<long int> resize(size.begin(), size.end());
   THLongStorage* szst = THLongStorage_newWithData(resize.data(), ndim);
 
   std::vector<long int> vec_sz(ndim, 1);
-  vec_sz[axis] = src.shape().dim(0);
+  vec_sz[axis] = THFloatTensor_numel(vec);
 
   std::vector<long int> expand_stride(ndim, 0);
   expand_stride[axis] = 1;
 
   THLongStorage* vec_szst = THLongStorage_newWithData(vec_sz.data(), ndim);
-  THFloatTensor* vec = THFloatTensor_newWithSize1d(src.shape().dim(0));
-  THCopy(src, vec);
 
   THFloatStorage* vec_storage = THFloatTensor_storage(vec);
   THLongStorage* expand_stridest = THLongStorage_newWithData(expand_stride.data(), ndim);
@@ -404,20 +617,26 @@ void THCopyAxis(const caffe::BlobProto& src, THFloatTensor* dest,
 
   THFloatTensor_resize(dest, szst, NULL);
   THFloatTensor_copy(dest, vec);
-
-  THFloatTensor_free(vec);
 }
 
-void ScaleLayer::Parameterize(THFloatTensor** tensors) {
+void ScaleLayer::Parameterize(THFloatTensor** tensors, THIntTensor** indices) {
   // tensors: scale_weight, scale_bias, add_weight, add_bias
-  auto& scale_params = params.scale_param();
-  std::vector<int> input_size = inputs[0]->GetOutputSizes()[0];
-  int axis = scale_params.axis() - 1;
+  if(params.scale_param().bias_term()) {
+    bias = THFloatTensor_newWithSize1d(BlobSize(params.blobs(1)));
+    CopyBlob(params.blobs(1), bias);
+  }
 
-  if(scale_params.bias_term())
-    THCopyAxis(params.blobs(1), tensors[3], input_size, axis);
+  CopyBlob(params.blobs(0), tensors[0]);
+}
 
-  THCopy(params.blobs(0), tensors[0]);
+void ScaleLayer::FinishParams(THFloatTensor** tensors, THIntTensor** indices) {
+  if(bias == nullptr)
+    return;
+  std::vector<int> input_size = inputs[0]->GetOutputSizes()[0];
+  int axis = params.scale_param().axis() - 1;
+  THCopyAxis(bias, tensors[3], input_size, axis);
+  THFloatTensor_free(bias);
+  bias = nullptr;
 }
 
 LayerInit(Softmax) {
@@ -6,7 +6,9 @@
     friend class Layer;                                         \
     protected:                                                  \
       NAME ## Layer(const caffe::LayerParameter& params,        \
-                    const std::vector<Layer*> inputs);
+                    const std::vector<Layer*> inputs,           \
+                    const LoadOptions& opts,                    \
+                    const Container* container);
 
 #define LayerDef(NAME)  \
   LayerBase(NAME)       \
@@ -15,7 +17,8 @@
 #define LayerParamDef(NAME)                             \
   LayerBase(NAME)                                       \
     public:                                             \
-      void Parameterize(THFloatTensor** tensors);       \
+      void Parameterize(THFloatTensor** tensors,        \
+                        THIntTensor** indices);         \
 };
 
 #define LayerExtDef(NAME, FIELDS)       \
@@ -27,25 +30,58 @@
 #define LayerExtParamDef(NAME, FIELDS)                  \
   LayerBase(NAME)                                       \
     public:                                             \
-      void Parameterize(THFloatTensor** tensors);       \
+      void Parameterize(THFloatTensor** tensors,        \
+                        THIntTensor** indices);         \
     private:                                            \
       FIELDS;                                           \
 };
 
 typedef std::tuple<std::string, std::string, std::string> modstrs;
 
+class Container;
+
+// mirrored by the LoadOptions cdef in init.lua
+struct LoadOptions {
+  float sparsity_threshold; // fraction of zero weights above which to store them sparsely
+};
+
+// the tensors of one layer's modules, filled by Parameterize;
+// mirrored by the LayerParams cdef in init.lua
+struct LayerParams {
+  int num_tensors;
+  THFloatTensor** tensors; // (weight, bias) of each module, or BatchNorm's running stats
+  int num_indices;
+  THIntTensor** indices;   // (row_ptr, col_idx) of each sparse module
+};
+
 class Layer {
   public:
     static Layer* MakeLayer(const caffe::LayerParameter& params,
-                            const std::vector<Layer*> inputs);
+                            const std::vector<Layer*> inputs,
+                            const LoadOptions& opts,
+                            const Container* container);
     virtual std::vector<std::vector<int>> GetOutputSizes();
-    virtual void Parameterize(THFloatTensor** tensors);
+    virtual void Parameterize(THFloatTensor** tensors, THIntTensor** indices);
+    // runs once the blobs queued by Parameterize have been inflated
+    virtual void FinishParams(THFloatTensor** tensors, THIntTensor** indices);
     virtual std::vector<modstrs> layer_strs();
     std::string name;
+    // container blobs that CopyBlob left for the model to inflate, together
+    // with every other layer's; each tensor holds a reference until then
+    std::vector<std::pair<const caffe::BlobProto*, THFloatTensor*>> queued_blobs;
   protected:
-    Layer(const caffe::LayerParameter& params, const std::vector<Layer*> inputs);
+    Layer(const caffe::LayerParameter& params, const std::vector<Layer*> inputs,
+          const LoadOptions& opts, const Container* container);
+    // blob data comes from the caffemodel or, for containers, is inflated:
+    // by the model after Parameterize for CopyBlob, at once for BlobData
+    long BlobSize(const caffe::BlobProto& blob);
+    void CopyBlob(const caffe::BlobProto& blob, THFloatTensor* dest);
+    const float* BlobData(const caffe::BlobProto& blob, std::vector<float>& buffer);
+    bool StoreSparse(const caffe::BlobProto& weight, int* nnz);
     const caffe::LayerParameter& params;
     std::vector<Layer*> inputs;
+    LoadOptions opts;
+    const Container* container;
     std::vector<modstrs> lua_layers;
     std::vector<std::vector<int>> output_sizes;
 };
@@ -55,7 +91,8 @@ class InputLayer: public Layer {
   public:
     std::vector<modstrs> layer_strs();
   protected:
-    InputLayer(const caffe::LayerParameter& params, const std::vector<Layer*> inputs);
+    InputLayer(const caffe::LayerParameter& params, const std::vector<Layer*> inputs,
+               const LoadOptions& opts, const Container* container);
 };
 
 LayerDef(Data);
@@ -68,13 +105,33 @@ LayerDef(Slice);
 LayerDef(Softmax);
 LayerDef(Tanh);
 LayerDef(EuclideanLoss);
-LayerParamDef(BatchNorm);
-LayerParamDef(InnerProduct);
-LayerParamDef(Scale);
-LayerExtParamDef(Convolution, int nInputPlane; int nOutputPlane;
-                              std::vector<unsigned int> k;
-                              std::vector<unsigned int> p;
-                              std::vector<unsigned int> d);
+LayerBase(BatchNorm)
+  public:
+    void Parameterize(THFloatTensor** tensors, THIntTensor** indices);
+    void FinishParams(THFloatTensor** tensors, THIntTensor** indices);
+  private:
+    THFloatTensor* scale_factor = nullptr;
+};
+LayerExtParamDef(InnerProduct, int nnz; bool sparse);
+LayerBase(Scale)
+  public:
+    void Parameterize(THFloatTensor** tensors, THIntTensor** indices);
+    void FinishParams(THFloatTensor** tensors, THIntTensor** indices);
+  private:
+    THFloatTensor* bias = nullptr;
+};
+LayerBase(Convolution)
+  public:
+    void Parameterize(THFloatTensor** tensors, THIntTensor** indices);
+  private:
+    std::string ConvModule(int nIn, int nOut);
+    int nInputPlane; int nOutputPlane;
+    int groups; bool depthwise;
+    int nnz; bool sparse;
+    std::vector<unsigned int> k;
+    std::vector<unsigned int> p;
+    std::vector<unsigned int> d;
+};
 LayerExtDef(Pooling, std::vector<unsigned int> k;
                      std::vector<unsigned int> p;
                      std::vector<unsigned int> d);
@@ -0,0 +1,39 @@
+extern "C" {
+  void csrmm(int transpose, int rows, int n, const int* row_ptr, const int* col_idx,
+             const float* values, const float* dense, float* out);
+  void csrgrad(int rows, int n, const int* row_ptr, const int* col_idx,
+               const float* grad_out, const float* input, float scale, float* grad_values);
+}
+
+// Accumulates the product of a (rows, cols) CSR matrix A with a dense,
+// row-major matrix of n columns:
+//   transpose == 0: out (rows x n) += A * dense (cols x n)
+//   transpose != 0: out (cols x n) += A^T * dense (rows x n)
+void csrmm(int transpose, int rows, int n, const int* row_ptr, const int* col_idx,
+           const float* values, const float* dense, float* out) {
+  for(int r = 0; r < rows; ++r) {
+    for(int j = row_ptr[r]; j < row_ptr[r+1]; ++j) {
+      float val = values[j];
+      const float* src = dense + (long)(transpose ? r : col_idx[j]) * n;
+      float* dst = out + (long)(transpose ? col_idx[j] : r) * n;
+      for(int i = 0; i < n; ++i)
+        dst[i] += val * src[i];
+    }
+  }
+}
+
+// Accumulates the gradient w.r.t. the nonzero values of A given the
+// gradient of out (rows x n) and the dense input (cols x n) of csrmm.
+void csrgrad(int rows, int n, const int* row_ptr, const int* col_idx,
+             const float* grad_out, const float* input, float scale, float* grad_values) {
+  for(int r = 0; r < rows; ++r) {
+    const float* go = grad_out + (long)r * n;
+    for(int j = row_ptr[r]; j < row_ptr[r+1]; ++j) {
+      const float* in = input + (long)col_idx[j] * n;
+      float dot = 0;
+      for(int i = 0; i < n; ++i)
+        dot += go[i] * in[i];
+      grad_values[j] += scale * dot;
+    }
+  }
+}